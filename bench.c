@@ -0,0 +1,76 @@
+#include "tweak.h"
+
+#include <time.h>
+
+
+static double time_table_loads(int fd, int n_iterations);
+
+
+// Loads and validates the table over and over, first the generic way and then, if the
+// table has the canonical geometry, the specialized way, and says how they compare.
+// Descriptions are switched off while the clock is running, since printing would swamp
+// everything else.
+void benchmark_table(int fd, char *devicename, int n_iterations) {
+    block header_block;
+    read_block(fd, 1, &header_block);
+    struct gpt_header *header = (struct gpt_header *) &header_block;
+    if(!validate_gpt_header(&header_block, 1) || !entry_geometry_is_sane(fd, header)) {
+	describe_failure("The table of %s can't be benchmarked.\n", devicename);
+	return;
+    }
+
+    int saved_failures = describe_failures;
+    int saved_successes = describe_successes;
+    int saved_trivia = describe_trivia;
+    describe_failures = describe_successes = describe_trivia = false;
+
+    bool saved_fast_path = canonical_fast_path;
+    canonical_fast_path = false;
+    double generic_time = time_table_loads(fd, n_iterations);
+    canonical_fast_path = true;
+    double canonical_time = time_table_loads(fd, n_iterations);
+    canonical_fast_path = saved_fast_path;
+
+    describe_failures = saved_failures;
+    describe_successes = saved_successes;
+    describe_trivia = saved_trivia;
+
+    printf("\nLoaded and validated the table of %s %i times each way.\n",
+	   devicename, n_iterations);
+    printf("  Generic path:    %10.2f us per table.\n", generic_time * 1e6 / n_iterations);
+    printf("  Canonical path:  %10.2f us per table.\n", canonical_time * 1e6 / n_iterations);
+
+    // The header and the array are specialized separately, so either may have been.
+    bool canonical_header = header->header_size == CANONICAL_HEADER_SIZE;
+    bool canonical_array = is_canonical_geometry(header);
+    printf("  The header took the %s path, and the entry array the %s path.\n",
+	   canonical_header ? "specialized" : "generic",
+	   canonical_array ? "specialized" : "generic");
+    if(canonical_header || canonical_array)
+	printf("  The canonical path saves %.1f%% of the time per table.\n",
+	       100.0 * (generic_time - canonical_time) / generic_time);
+    else
+	printf("  Nothing about this table is canonical, so both runs were generic.\n");
+}
+
+
+static double time_table_loads(int fd, int n_iterations) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int i;
+    for(i = 0; i < n_iterations; i++) {
+	block header_block;
+	read_block(fd, 1, &header_block);
+	validate_gpt_header(&header_block, 1);
+
+	struct gpt_header *header = (struct gpt_header *) &header_block;
+	block *entry_blocks = load_entry_array(fd, header);
+	if(!entry_blocks) exit(1);
+	validate_entry_array(header, entry_blocks);
+	free(entry_blocks);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
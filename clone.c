@@ -0,0 +1,254 @@
+#include "tweak.h"
+
+#include <pthread.h>
+#include <sys/random.h>
+
+// Cloning is nearly all waiting on writes, so this is about how many disks to keep busy at
+// once rather than how many cores there are.
+#define MAX_CLONE_THREADS 16
+
+struct clone_job {
+    block *mbr_block;
+    block *header_block;
+    block *entry_blocks;
+    char **targets;
+    int n_targets;
+    int next_target;
+    bool *results;
+};
+
+
+static void *clone_worker(void *job);
+static bool clone_to_target(struct clone_job *job, char *target);
+static void fix_protective_mbr(block *mbr_block, lba last_lba);
+static void seed_uuid_generator(void);
+static void generate_uuid(uuid *result);
+static uint64_t next_random(void);
+
+
+// xoshiro256**, seeded from the kernel once per thread.  It's nowhere near good enough for
+// keys, but plenty for making sure no two partitions anywhere ever share a GUID.
+static __thread uint64_t random_state[4];
+
+
+// Stamps the template's table onto every target, with fresh GUIDs and with the backup
+// structures moved to wherever each target actually ends.  Returns how many failed.
+int clone_table(int template_fd, char **targets, int n_targets) {
+    block mbr_block, header_block;
+    read_block(template_fd, 0, &mbr_block);
+    block *entry_blocks = load_table(template_fd, &header_block);
+    if(!entry_blocks) {
+	describe_failure("The template doesn't validate, so it won't be cloned.\n");
+	return n_targets;
+    }
+
+    struct clone_job job;
+    job.mbr_block = &mbr_block;
+    job.header_block = &header_block;
+    job.entry_blocks = entry_blocks;
+    job.targets = targets;
+    job.n_targets = n_targets;
+    job.next_target = 0;
+    job.results = calloc(n_targets, sizeof(bool));
+
+    int n_threads = n_targets;
+    if(n_threads > MAX_CLONE_THREADS) n_threads = MAX_CLONE_THREADS;
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+
+    printf("\nCloning onto %i targets, up to %i at a time.\n", n_targets, n_threads);
+    fflush(stdout);
+
+    // Threads that don't start just leave more targets for the ones that did; if none
+    // start at all, this thread does the lot by itself.
+    int i, n_started = 0;
+    for(i = 0; i < n_threads; i++) {
+	int error = pthread_create(&threads[n_started], NULL, clone_worker, &job);
+	if(error) {
+	    fprintf(stderr, "Unable to start a cloning thread: %s\n", strerror(error));
+	    break;
+	}
+	n_started++;
+    }
+    if(!n_started) clone_worker(&job);
+    for(i = 0; i < n_started; i++)
+	pthread_join(threads[i], NULL);
+
+    int n_failures = 0;
+    for(i = 0; i < n_targets; i++) {
+	if(job.results[i]) describe_success("Cloned onto %s.\n", targets[i]);
+	else {
+	    describe_failure("Couldn't clone onto %s.\n", targets[i]);
+	    n_failures++;
+	}
+    }
+
+    free(threads);
+    free(job.results);
+    free(entry_blocks);
+    return n_failures;
+}
+
+
+static void *clone_worker(void *arg) {
+    struct clone_job *job = (struct clone_job *) arg;
+
+    seed_uuid_generator();
+
+    while(1) {
+	int i = __atomic_fetch_add(&job->next_target, 1, __ATOMIC_RELAXED);
+	if(i >= job->n_targets) break;
+	job->results[i] = clone_to_target(job, job->targets[i]);
+    }
+
+    return NULL;
+}
+
+
+static bool clone_to_target(struct clone_job *job, char *target) {
+    struct gpt_header *template = (struct gpt_header *) job->header_block;
+
+    int fd = open_device(target, O_RDWR);
+    if(fd == -1) return false;
+
+    uint64_t size;
+    if(!get_device_size(fd, &size)) {
+	close(fd);
+	return false;
+    }
+
+    uint64_t entry_size = total_entry_size(template);
+    lba n_entry_blocks = (entry_size + sizeof(block) - 1) / sizeof(block);
+    lba last_lba = size / sizeof(block) - 1;
+    lba last_usable_lba = last_lba - 1 - n_entry_blocks;
+
+    if(size / sizeof(block) < 2 * n_entry_blocks + 3
+       || last_usable_lba < template->first_usable_lba)
+    {
+	fprintf(stderr, "%s is too small to hold the template's table at all.\n", target);
+	close(fd);
+	return false;
+    }
+
+    // Everything from here on is built in memory first; nothing is written unless all of
+    // it makes sense.
+    block primary_blocks[2];
+    memcpy(&primary_blocks[0], job->mbr_block, sizeof(block));
+    memcpy(&primary_blocks[1], job->header_block, sizeof(block));
+    fix_protective_mbr(&primary_blocks[0], last_lba);
+
+    block *backup_blocks = malloc((n_entry_blocks + 1) * sizeof(block));
+    block *entry_blocks = backup_blocks;
+    memcpy(entry_blocks, job->entry_blocks, n_entry_blocks * sizeof(block));
+
+    struct gpt_header *header = (struct gpt_header *) &primary_blocks[1];
+
+    lba i;
+    for(i = 0; i < header->number_of_partition_entries; i++) {
+	struct partition_entry *entry = get_partition_entry(header, entry_blocks, i);
+	if(entry_is_unused(entry)) continue;
+
+	if(entry->ending_lba > last_usable_lba) {
+	    fprintf(stderr, "Entry %Li ends at LBA %Li, past the end of %s at %Li.\n",
+		    i, entry->ending_lba, target, last_usable_lba);
+	    free(backup_blocks);
+	    close(fd);
+	    return false;
+	}
+
+	generate_uuid(&entry->unique_partition_uuid);
+    }
+
+    generate_uuid(&header->disk_uuid);
+    header->alternate_lba = last_lba;
+    header->last_usable_lba = last_usable_lba;
+    header->partition_entry_array_crc32 = compute_entry_crc32(header, entry_blocks);
+    header->header_crc32 = compute_header_crc32(&primary_blocks[1]);
+
+    block *backup_header_block = &backup_blocks[n_entry_blocks];
+    memcpy(backup_header_block, &primary_blocks[1], sizeof(block));
+    struct gpt_header *backup_header = (struct gpt_header *) backup_header_block;
+    backup_header->my_lba = last_lba;
+    backup_header->alternate_lba = 1;
+    backup_header->partition_entry_lba = last_usable_lba + 1;
+    backup_header->header_crc32 = compute_header_crc32(backup_header_block);
+
+    bool result =
+	write_bytes(fd, 0, primary_blocks, sizeof(primary_blocks))
+	&& write_bytes(fd, header->partition_entry_lba * sizeof(block),
+		       entry_blocks, n_entry_blocks * sizeof(block))
+	&& write_bytes(fd, (last_usable_lba + 1) * sizeof(block),
+		       backup_blocks, (n_entry_blocks + 1) * sizeof(block));
+    if(result && fsync(fd) == -1) {
+	fprintf(stderr, "Unable to flush %s: %s\n", target, strerror(errno));
+	result = false;
+    }
+
+    free(backup_blocks);
+    close(fd);
+    return result;
+}
+
+
+// The template's protective partition covered the template's disk, not this one.  Hybrid
+// MBRs keep their other records exactly as they were.
+static void fix_protective_mbr(block *mbr_block, lba last_lba) {
+    uint8_t *mbr = (uint8_t *) mbr_block;
+    if(mbr[510] != 0x55 || mbr[511] != 0xAA) return;
+
+    int i;
+    for(i = 0; i < 4; i++) {
+	uint8_t *record = mbr + 446 + 16*i;
+	if(record[4] != 0xEE) continue;
+
+	uint32_t n_sectors = last_lba > 0xFFFFFFFF ? 0xFFFFFFFF : last_lba;
+	record[12] = n_sectors & 0xFF;
+	record[13] = (n_sectors >> 8) & 0xFF;
+	record[14] = (n_sectors >> 16) & 0xFF;
+	record[15] = (n_sectors >> 24) & 0xFF;
+    }
+}
+
+
+static void seed_uuid_generator(void) {
+    do {
+	if(getrandom(random_state, sizeof(random_state), 0) != sizeof(random_state)) {
+	    fprintf(stderr, "Unable to get randomness from the kernel: %s\n", strerror(errno));
+	    exit(1);
+	}
+    } while(!(random_state[0] | random_state[1] | random_state[2] | random_state[3]));
+}
+
+
+// A version 4 UUID, written in on-disk order.
+static void generate_uuid(uuid *result) {
+    uint64_t halves[2];
+    halves[0] = next_random();
+    halves[1] = next_random();
+
+    uint8_t *bytes = (uint8_t *) result;
+    memcpy(bytes, halves, sizeof(uuid));
+    bytes[6] = (bytes[6] & 0x0F) | 0x40;
+    bytes[8] = (bytes[8] & 0x3F) | 0x80;
+    swab_uuid(result);
+}
+
+
+static inline uint64_t rotate_left(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+
+static uint64_t next_random(void) {
+    uint64_t *s = random_state;
+    uint64_t result = rotate_left(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotate_left(s[3], 45);
+
+    return result;
+}
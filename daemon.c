@@ -0,0 +1,610 @@
+#define _GNU_SOURCE
+
+#include "tweak.h"
+
+#include <fnmatch.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Anything longer than this can't be a sensible request, and the client gets dropped.
+#define MAX_REQUEST 1024
+#define MAX_EVENTS 64
+// Once this much is waiting to go out to a client, it isn't listened to until some of it
+// has gone.
+#define MAX_BACKLOG (1024 * 1024)
+
+// The protocol is one request per line, answered by either "error <why>" or "ok <n>"
+// followed by n lines of results:
+//
+//   validate DEVICE                      ok 0, or error saying why not
+//   list DEVICE                          one line per entry in use
+//   query DEVICE INDEX                   that one entry
+//   find PATTERN                         entries on any device whose name matches
+//   patch DEVICE INDEX name NEW-NAME     rename an entry, on disk
+//   patch DEVICE INDEX attributes HEX    set an entry's attributes, on disk
+//
+// DEVICE is either the name it was given on the command line or its position there,
+// counting from zero.  Entries come out as
+//
+//   [DEVICE ]INDEX TYPE-UUID PARTITION-UUID STARTING-LBA ENDING-LBA ATTRIBUTES NAME
+//
+// with the device only included for find.
+
+struct served_device {
+    // Read through struct gpt_header, so it needs that structure's alignment.
+    block header_block __attribute__((aligned(8)));
+    block *entry_blocks;
+    char *name;
+    int fd;
+    bool writable;
+    bool valid;
+};
+
+struct client {
+    int fd;
+    char input[MAX_REQUEST];
+    size_t n_input;
+    char *output;
+    size_t n_output;
+    size_t n_sent;
+    size_t output_size;
+    bool finished;
+};
+
+
+static volatile sig_atomic_t daemon_stopping = 0;
+
+
+static void stop_daemon(int signal_number);
+static int listen_on(char *socket_path);
+static void accept_clients(int epoll_fd, int listen_fd);
+static bool read_from_client(int epoll_fd, struct client *client,
+			     struct served_device *devices, int n_devices);
+static void handle_buffered_requests(struct client *client,
+				     struct served_device *devices, int n_devices);
+static bool flush_client(int epoll_fd, struct client *client);
+static bool client_backlogged(struct client *client);
+static void drop_client(struct client *client);
+static void handle_request(struct client *client, char *request,
+			   struct served_device *devices, int n_devices);
+static void respond(struct client *client, char *fmt, ...);
+static void respond_entry(struct client *client, struct served_device *device, lba index,
+			  bool with_device);
+static struct served_device *find_device(char *name, struct served_device *devices,
+					 int n_devices);
+static struct partition_entry *find_entry(struct client *client,
+					  struct served_device *device, char *index_text,
+					  lba *index);
+static void refresh_device(struct served_device *device);
+static void forget_device_table(struct served_device *device);
+static bool write_device_table(struct served_device *device);
+
+
+// Keeps the tables of all the given devices loaded and answers questions about them on
+// a Unix socket, until told to stop.  Returns false if it couldn't get going at all.
+bool serve_tables(char *socket_path, char **devicenames, int n_devices) {
+    struct served_device *devices = calloc(n_devices, sizeof(struct served_device));
+
+    int i;
+    for(i = 0; i < n_devices; i++) {
+	devices[i].name = devicenames[i];
+	devices[i].writable = true;
+	devices[i].fd = open_device(devicenames[i], O_RDWR);
+	if(devices[i].fd == -1) {
+	    devices[i].writable = false;
+	    devices[i].fd = open_device(devicenames[i], O_RDONLY);
+	}
+	if(devices[i].fd == -1) return false;
+
+	printf("\nServing %s%s.\n", devicenames[i],
+	       devices[i].writable ? "" : ", which can't be patched");
+	refresh_device(&devices[i]);
+    }
+
+    int listen_fd = listen_on(socket_path);
+    if(listen_fd == -1) return false;
+
+    int epoll_fd = epoll_create1(0);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    struct sigaction action;
+    bzero(&action, sizeof(action));
+    action.sa_handler = stop_daemon;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("\nListening on %s.\n", socket_path);
+    fflush(stdout);
+
+    struct epoll_event events[MAX_EVENTS];
+    while(!daemon_stopping) {
+	int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+	if(n_events == -1) {
+	    if(errno == EINTR) continue;
+	    fprintf(stderr, "Unable to wait for clients: %s\n", strerror(errno));
+	    break;
+	}
+
+	for(i = 0; i < n_events; i++) {
+	    struct client *client = (struct client *) events[i].data.ptr;
+	    if(!client) {
+		accept_clients(epoll_fd, listen_fd);
+		continue;
+	    }
+
+	    bool okay = true;
+	    if(events[i].events & (EPOLLERR | EPOLLHUP)) okay = false;
+	    if(okay && (events[i].events & EPOLLIN))
+		okay = read_from_client(epoll_fd, client, devices, n_devices);
+	    if(okay && (events[i].events & EPOLLOUT)) {
+		okay = flush_client(epoll_fd, client);
+		// Requests held back while the client was behind can be answered now.
+		if(okay && !client_backlogged(client))
+		    okay = read_from_client(epoll_fd, client, devices, n_devices);
+	    }
+	    if(!okay) drop_client(client);
+	}
+    }
+
+    printf("\nNo longer listening on %s.\n", socket_path);
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+
+    for(i = 0; i < n_devices; i++) {
+	close(devices[i].fd);
+	free(devices[i].entry_blocks);
+    }
+    free(devices);
+
+    return true;
+}
+
+
+static void stop_daemon(int signal_number) {
+    daemon_stopping = 1;
+}
+
+
+static int listen_on(char *socket_path) {
+    struct sockaddr_un address;
+    bzero(&address, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(address.sun_path)) {
+	fprintf(stderr, "The socket path %s is too long.\n", socket_path);
+	return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listen_fd == -1) {
+	fprintf(stderr, "Unable to make a socket: %s\n", strerror(errno));
+	return -1;
+    }
+
+    // A socket left over from last time would otherwise make the bind fail.
+    unlink(socket_path);
+    if(bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) == -1
+       || listen(listen_fd, SOMAXCONN) == -1)
+    {
+	fprintf(stderr, "Unable to listen on %s: %s\n", socket_path, strerror(errno));
+	close(listen_fd);
+	return -1;
+    }
+
+    return listen_fd;
+}
+
+
+static void accept_clients(int epoll_fd, int listen_fd) {
+    while(1) {
+	int client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(client_fd == -1) {
+	    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		fprintf(stderr, "Unable to accept a client: %s\n", strerror(errno));
+	    return;
+	}
+
+	struct client *client = calloc(1, sizeof(struct client));
+	client->fd = client_fd;
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = client;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+    }
+}
+
+
+static bool read_from_client(int epoll_fd, struct client *client,
+			     struct served_device *devices, int n_devices) {
+    while(1) {
+	handle_buffered_requests(client, devices, n_devices);
+	if(client_backlogged(client) || client->finished) break;
+	if(client->n_input == sizeof(client->input)) return false;
+
+	ssize_t result = read(client->fd, client->input + client->n_input,
+			      sizeof(client->input) - client->n_input);
+	if(result == 0) {
+	    // The client won't say anything more, but still gets its answers.
+	    client->finished = true;
+	    continue;
+	}
+	if(result == -1) {
+	    if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+	    if(errno == EINTR) continue;
+	    return false;
+	}
+	client->n_input += result;
+    }
+
+    return flush_client(epoll_fd, client);
+}
+
+
+// Answers whole lines already read, for as long as the client is keeping up.
+static void handle_buffered_requests(struct client *client,
+				     struct served_device *devices, int n_devices) {
+    char *line = client->input;
+    char *newline;
+    while(!client_backlogged(client)
+	  && (newline = memchr(line, '\n', client->input + client->n_input - line)))
+    {
+	*newline = '\0';
+	if(newline > line && newline[-1] == '\r') newline[-1] = '\0';
+	handle_request(client, line, devices, n_devices);
+	line = newline + 1;
+    }
+
+    client->n_input -= line - client->input;
+    memmove(client->input, line, client->n_input);
+}
+
+
+// Sends whatever it can without blocking, then listens for whichever of more requests
+// and room to send is wanted next.
+static bool flush_client(int epoll_fd, struct client *client) {
+    while(client->n_sent < client->n_output) {
+	ssize_t result = write(client->fd, client->output + client->n_sent,
+			       client->n_output - client->n_sent);
+	if(result == -1) {
+	    if(errno == EINTR) continue;
+	    if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+	    return false;
+	}
+	client->n_sent += result;
+    }
+
+    if(client->n_sent == client->n_output) {
+	client->n_output = 0;
+	client->n_sent = 0;
+	if(client->finished) return false;
+    } else if(client->n_sent) {
+	// Whatever's left moves to the front, so that the buffer only ever has to hold the
+	// backlog rather than everything ever said to a client that never quite catches up.
+	client->n_output -= client->n_sent;
+	memmove(client->output, client->output + client->n_sent, client->n_output);
+	client->n_sent = 0;
+    }
+
+    struct epoll_event event;
+    event.events = 0;
+    if(!client->finished && !client_backlogged(client)) event.events |= EPOLLIN;
+    if(client->n_sent < client->n_output) event.events |= EPOLLOUT;
+    event.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+    return true;
+}
+
+
+static bool client_backlogged(struct client *client) {
+    return client->n_output - client->n_sent > MAX_BACKLOG;
+}
+
+
+static void drop_client(struct client *client) {
+    close(client->fd);
+    free(client->output);
+    free(client);
+}
+
+
+static void handle_request(struct client *client, char *request,
+			   struct served_device *devices, int n_devices) {
+    char *verb = strtok(request, " \t");
+    if(!verb) return;
+
+    if(!strcmp(verb, "find")) {
+	char *pattern = strtok(NULL, "");
+	if(!pattern) {
+	    respond(client, "error find needs a pattern\n");
+	    return;
+	}
+
+	// The count has to come first, so the matches are gathered up before answering.
+	struct client matches;
+	bzero(&matches, sizeof(matches));
+	lba n_matches = 0;
+
+	int i;
+	for(i = 0; i < n_devices; i++) {
+	    refresh_device(&devices[i]);
+	    if(!devices[i].valid) continue;
+
+	    struct gpt_header *header = (struct gpt_header *) &devices[i].header_block;
+	    char name[NAME_UTF8_SIZE];
+	    lba j;
+	    for(j = 0; j < header->number_of_partition_entries; j++) {
+		struct partition_entry *entry
+		    = get_partition_entry(header, devices[i].entry_blocks, j);
+		if(entry_is_unused(entry)) continue;
+		decode_partition_name(entry->partition_name, name);
+		if(fnmatch(pattern, name, 0)) continue;
+		respond_entry(&matches, &devices[i], j, true);
+		n_matches++;
+	    }
+	}
+
+	respond(client, "ok %Li\n", n_matches);
+	if(matches.n_output) respond(client, "%.*s", (int) matches.n_output, matches.output);
+	free(matches.output);
+	return;
+    }
+
+    if(strcmp(verb, "validate") && strcmp(verb, "list") && strcmp(verb, "query")
+       && strcmp(verb, "patch"))
+    {
+	respond(client, "error unknown request %s\n", verb);
+	return;
+    }
+
+    char *device_name = strtok(NULL, " \t");
+    struct served_device *device = device_name
+	? find_device(device_name, devices, n_devices) : NULL;
+    if(!device) {
+	respond(client, "error no such device\n");
+	return;
+    }
+
+    refresh_device(device);
+    if(!strcmp(verb, "validate")) {
+	if(device->valid) respond(client, "ok 0\n");
+	else respond(client, "error the table can't be read or doesn't validate\n");
+	return;
+    }
+    if(!device->valid) {
+	respond(client, "error the table can't be read or doesn't validate\n");
+	return;
+    }
+
+    struct gpt_header *header = (struct gpt_header *) &device->header_block;
+    lba index;
+
+    if(!strcmp(verb, "list")) {
+	lba n_used = 0;
+	for(index = 0; index < header->number_of_partition_entries; index++)
+	    if(!entry_is_unused(get_partition_entry(header, device->entry_blocks, index)))
+		n_used++;
+
+	respond(client, "ok %Li\n", n_used);
+	for(index = 0; index < header->number_of_partition_entries; index++)
+	    if(!entry_is_unused(get_partition_entry(header, device->entry_blocks, index)))
+		respond_entry(client, device, index, false);
+    } else if(!strcmp(verb, "query")) {
+	if(!find_entry(client, device, strtok(NULL, " \t"), &index)) return;
+	respond(client, "ok 1\n");
+	respond_entry(client, device, index, false);
+    } else if(!strcmp(verb, "patch")) {
+	struct partition_entry *entry = find_entry(client, device, strtok(NULL, " \t"), &index);
+	if(!entry) return;
+
+	char *field = strtok(NULL, " \t");
+	char *value = strtok(NULL, "");
+	if(!field || !value) {
+	    respond(client, "error patch needs a field and a value\n");
+	    return;
+	}
+	if(!device->writable) {
+	    respond(client, "error that device is read-only\n");
+	    return;
+	}
+
+	struct partition_entry original;
+	memcpy(&original, entry, sizeof(original));
+
+	if(!strcmp(field, "name")) {
+	    if(!encode_partition_name(value, entry->partition_name)) {
+		respond(client, "error that name isn't UTF-8 or is too long\n");
+		return;
+	    }
+	} else if(!strcmp(field, "attributes")) {
+	    char *end;
+	    entry->attributes = strtoull(value, &end, 16);
+	    if(*end || end == value) {
+		entry->attributes = original.attributes;
+		respond(client, "error attributes should be given in hex\n");
+		return;
+	    }
+	} else {
+	    respond(client, "error only name and attributes can be patched\n");
+	    return;
+	}
+
+	// The copy in memory may now be neither what was asked for nor what's on the device,
+	// header CRCs included, so it's dropped and the next request reads the device afresh.
+	if(!write_device_table(device)) {
+	    forget_device_table(device);
+	    respond(client, "error the patch couldn't be written\n");
+	    return;
+	}
+
+	respond(client, "ok 1\n");
+	respond_entry(client, device, index, false);
+    }
+}
+
+
+static void respond(struct client *client, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int length = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if(client->n_output + length + 1 > client->output_size) {
+	client->output_size = (client->n_output + length + 1) * 2;
+	client->output = realloc(client->output, client->output_size);
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(client->output + client->n_output, length + 1, fmt, ap);
+    va_end(ap);
+    client->n_output += length;
+}
+
+
+static void respond_entry(struct client *client, struct served_device *device, lba index,
+			  bool with_device) {
+    struct gpt_header *header = (struct gpt_header *) &device->header_block;
+    struct partition_entry *entry = get_partition_entry(header, device->entry_blocks, index);
+
+    uuid type_uuid, partition_uuid;
+    swab_and_copy_uuid(&type_uuid, &entry->partition_type_uuid);
+    swab_and_copy_uuid(&partition_uuid, &entry->unique_partition_uuid);
+    char name[NAME_UTF8_SIZE];
+    decode_partition_name(entry->partition_name, name);
+
+    if(with_device) respond(client, "%s ", device->name);
+    respond(client, "%Li %s", index, uuid_to_ascii(type_uuid));
+    respond(client, " %s %Li %Li %016Lx %s\n", uuid_to_ascii(partition_uuid),
+	    entry->starting_lba, entry->ending_lba, entry->attributes, name);
+}
+
+
+static struct served_device *find_device(char *name, struct served_device *devices,
+					 int n_devices) {
+    int i;
+    for(i = 0; i < n_devices; i++)
+	if(!strcmp(devices[i].name, name)) return &devices[i];
+
+    char *end;
+    long position = strtol(name, &end, 10);
+    if(!*end && end != name && position >= 0 && position < n_devices)
+	return &devices[position];
+
+    return NULL;
+}
+
+
+static struct partition_entry *find_entry(struct client *client,
+					  struct served_device *device, char *index_text,
+					  lba *index) {
+    struct gpt_header *header = (struct gpt_header *) &device->header_block;
+
+    char *end = NULL;
+    if(index_text) *index = strtoull(index_text, &end, 10);
+    if(!index_text || *end || end == index_text
+       || *index >= header->number_of_partition_entries)
+    {
+	respond(client, "error no such entry\n");
+	return NULL;
+    }
+
+    return get_partition_entry(header, device->entry_blocks, *index);
+}
+
+
+// The header is re-read on every request; if the whole block is byte for byte what was
+// loaded, the loaded copy is still good.  That trusts the array CRC in the header to
+// change whenever the array does, which any well-behaved writer sees to.
+static void refresh_device(struct served_device *device) {
+    STATS_DEVICE(device->name);
+
+    block header_block __attribute__((aligned(8)));
+    if(!try_read_block(device->fd, 1, &header_block)) {
+	// Nothing loaded can be trusted any more; the next request starts over.
+	forget_device_table(device);
+	describe_failure("The header of %s can't be read.\n", device->name);
+	return;
+    }
+
+    if(device->entry_blocks
+       && !memcmp(&header_block, &device->header_block, sizeof(block)))
+    {
+	STATS_COUNT(COUNTER_CACHE_HITS, 1);
+	return;
+    }
+
+    free(device->entry_blocks);
+    device->entry_blocks = load_table(device->fd, &device->header_block);
+    device->valid = device->entry_blocks != NULL;
+    if(!device->valid) {
+	// Remember the header anyway, so that the same bad table isn't reloaded every time.
+	memcpy(&device->header_block, &header_block, sizeof(block));
+	device->entry_blocks = calloc(1, sizeof(block));
+	describe_failure("The table on %s doesn't validate.\n", device->name);
+    }
+}
+
+
+static void forget_device_table(struct served_device *device) {
+    free(device->entry_blocks);
+    device->entry_blocks = NULL;
+    device->valid = false;
+}
+
+
+// Puts the loaded table back on the device, both copies of it, with fresh CRCs.  The
+// backup header is read back from the device so that its array goes where it was.
+static bool write_device_table(struct served_device *device) {
+    struct gpt_header *header = (struct gpt_header *) &device->header_block;
+
+    block backup_header_block __attribute__((aligned(8)));
+    if(!try_read_block(device->fd, header->alternate_lba, &backup_header_block)) {
+	describe_failure("The backup header of %s can't be read, so it won't be patched.\n",
+			 device->name);
+	return false;
+    }
+    if(!validate_gpt_header(&backup_header_block, header->alternate_lba)) {
+	describe_failure("The backup header on %s doesn't validate, so it won't be patched.\n",
+			 device->name);
+	return false;
+    }
+    struct gpt_header *backup_header = (struct gpt_header *) &backup_header_block;
+
+    // The backup array is about to be overwritten with the primary one, so it had better
+    // be the same shape and actually be on the device.
+    if(backup_header->number_of_partition_entries != header->number_of_partition_entries
+       || backup_header->size_of_partition_entry != header->size_of_partition_entry
+       || !entry_geometry_is_sane(device->fd, backup_header))
+    {
+	describe_failure("The backup entry array on %s doesn't fit the primary one, so it "
+			 "won't be patched.\n", device->name);
+	return false;
+    }
+
+    header->partition_entry_array_crc32 = compute_entry_crc32(header, device->entry_blocks);
+    header->header_crc32 = compute_header_crc32(&device->header_block);
+    backup_header->partition_entry_array_crc32 = header->partition_entry_array_crc32;
+    backup_header->header_crc32 = compute_header_crc32(&backup_header_block);
+
+    // The backup goes first, so that a patch that dies half way through leaves the primary
+    // table as it was.
+    uint64_t size = total_entry_size(header);
+    bool result =
+	write_bytes(device->fd, backup_header->partition_entry_lba * sizeof(block),
+		    device->entry_blocks, size)
+	&& write_bytes(device->fd, header->alternate_lba * sizeof(block),
+		       &backup_header_block, sizeof(block))
+	&& write_bytes(device->fd, header->partition_entry_lba * sizeof(block),
+		       device->entry_blocks, size)
+	&& write_bytes(device->fd, sizeof(block), &device->header_block, sizeof(block))
+	&& fsync(device->fd) != -1;
+
+    return result;
+}
@@ -0,0 +1,322 @@
+#include "tweak.h"
+
+
+// How many entries are pulled in per read while streaming the two arrays side by side.
+#define ENTRIES_PER_READ 32
+
+struct entry_stream {
+    int fd;
+    struct gpt_header *header;
+    uint64_t offset;
+    uint32_t n_unread;
+    uint32_t n_buffered;
+    uint32_t next;
+    uint32_t crc32;
+    bool failed;
+    uint8_t *buffer;
+};
+
+
+static void compare_headers(struct gpt_header *a, struct gpt_header *b, lba *n_differences);
+static void compare_entries(lba index, struct partition_entry *a, struct partition_entry *b,
+			    lba *n_differences);
+static void start_entry_stream(struct entry_stream *stream, int fd,
+			       struct gpt_header *header);
+static uint8_t *next_entry(struct entry_stream *stream);
+static uint64_t hash_entry(uint8_t *entry, uint32_t size);
+static bool entry_is_empty(uint8_t *entry, uint32_t size);
+static bool entries_equal(uint8_t *a, uint32_t size_a, uint8_t *b, uint32_t size_b);
+
+
+// Returns 0 if the two tables are the same, 1 if they differ, -1 if they can't be compared
+// at all or either array doesn't match its CRC32.  Differences are printed as they're
+// found.
+int diff_tables(int fd_a, char *name_a, int fd_b, char *name_b) {
+    printf("\nComparing %s with %s.\n", name_a, name_b);
+
+    block header_blocks[2];
+    if(!try_read_block(fd_a, 1, &header_blocks[0])
+       || !try_read_block(fd_b, 1, &header_blocks[1]))
+	return -1;
+
+    bool headers_okay = true;
+    if(!validate_gpt_header(&header_blocks[0], 1)) {
+	describe_failure("The header of %s doesn't validate.\n", name_a);
+	headers_okay = false;
+    }
+    if(!validate_gpt_header(&header_blocks[1], 1)) {
+	describe_failure("The header of %s doesn't validate.\n", name_b);
+	headers_okay = false;
+    }
+    if(!headers_okay) return -1;
+
+    struct gpt_header *a = (struct gpt_header *) &header_blocks[0];
+    struct gpt_header *b = (struct gpt_header *) &header_blocks[1];
+
+    // Anything past here believes the headers' geometry enough to allocate and read by it.
+    if(!entry_geometry_is_sane(fd_a, a)) {
+	describe_failure("The entry array of %s can't be compared.\n", name_a);
+	return -1;
+    }
+    if(!entry_geometry_is_sane(fd_b, b)) {
+	describe_failure("The entry array of %s can't be compared.\n", name_b);
+	return -1;
+    }
+
+    lba n_differences = 0;
+    compare_headers(a, b, &n_differences);
+
+    // This trusts the array CRCs the headers claim.  Validating a header doesn't look at
+    // its array, so two arrays corrupted in the same way behind unchanged headers, or one
+    // corrupted array whose header still matches the other's, will be called the same.
+    if(a->number_of_partition_entries == b->number_of_partition_entries
+       && a->size_of_partition_entry == b->size_of_partition_entry
+       && a->partition_entry_array_crc32 == b->partition_entry_array_crc32)
+    {
+	describe_success("The entry arrays have the same CRC32, so they're the same.\n");
+	printf("  %Li differences.\n", n_differences);
+	return n_differences ? 1 : 0;
+    }
+
+    struct entry_stream streams[2];
+    start_entry_stream(&streams[0], fd_a, a);
+    start_entry_stream(&streams[1], fd_b, b);
+
+    lba n_entries = a->number_of_partition_entries;
+    if(b->number_of_partition_entries > n_entries)
+	n_entries = b->number_of_partition_entries;
+
+    uint64_t *hashes[2];
+    hashes[0] = calloc(n_entries, sizeof(uint64_t));
+    hashes[1] = calloc(n_entries, sizeof(uint64_t));
+    bool *differs = calloc(n_entries, sizeof(bool));
+
+    // Entries are compared as though zero-padded to the longer size; the hashes are only
+    // for noticing entries that moved.
+    struct partition_entry padded[2];
+    bool failed = false;
+    lba i;
+    int side;
+    for(i = 0; i < n_entries && !failed; i++) {
+	uint8_t *entries[2];
+	uint32_t sizes[2];
+	for(side = 0; side < 2; side++) {
+	    entries[side] = next_entry(&streams[side]);
+	    sizes[side] = streams[side].header->size_of_partition_entry;
+	    if(streams[side].failed) failed = true;
+	    if(entries[side] && !entry_is_empty(entries[side], sizes[side]))
+		hashes[side][i] = hash_entry(entries[side], sizes[side]);
+	}
+	if(failed) break;
+
+	if(entries_equal(entries[0], sizes[0], entries[1], sizes[1])) continue;
+	differs[i] = true;
+
+	for(side = 0; side < 2; side++)
+	    if(entries[side] && sizes[side] < sizeof(struct partition_entry)) {
+		bzero(&padded[side], sizeof(struct partition_entry));
+		memcpy(&padded[side], entries[side], sizes[side]);
+		entries[side] = (uint8_t *) &padded[side];
+	    }
+
+	if(!hashes[0][i]) {
+	    printf("  Entry %Li is only in %s.\n", i, name_b);
+	    n_differences++;
+	} else if(!hashes[1][i]) {
+	    printf("  Entry %Li is only in %s.\n", i, name_a);
+	    n_differences++;
+	} else compare_entries(i, (struct partition_entry *) entries[0],
+			       (struct partition_entry *) entries[1], &n_differences);
+    }
+
+    for(side = 0; side < 2; side++) {
+	uint32_t crc32 = efi_crc32_end(streams[side].crc32);
+	if(!failed && crc32 != streams[side].header->partition_entry_array_crc32) {
+	    describe_failure("The entry array of %s doesn't match its CRC32.\n",
+			     side ? name_b : name_a);
+	    failed = true;
+	}
+	free(streams[side].buffer);
+    }
+    if(failed) {
+	free(hashes[0]);
+	free(hashes[1]);
+	free(differs);
+	return -1;
+    }
+
+    // Anything that vanished from one slot and turned up unchanged in another was
+    // probably moved rather than edited.
+    lba j;
+    for(i = 0; i < n_entries; i++) {
+	if(!differs[i] || !hashes[0][i]) continue;
+	for(j = 0; j < n_entries; j++)
+	    if(j != i && differs[j] && hashes[1][j] == hashes[0][i]) {
+		printf("  Entry %Li in %s looks like it moved to %Li in %s.\n",
+		       i, name_a, j, name_b);
+		break;
+	    }
+    }
+
+    free(hashes[0]);
+    free(hashes[1]);
+    free(differs);
+
+    printf("  %Li differences.\n", n_differences);
+    return n_differences ? 1 : 0;
+}
+
+
+static void compare_headers(struct gpt_header *a, struct gpt_header *b, lba *n_differences) {
+#define COMPARE_FIELD(field, format)					\
+    if(a->field != b->field) {						\
+	printf("  Header " #field ": " format " -> " format "\n", a->field, b->field); \
+	(*n_differences)++;						\
+    }
+
+    COMPARE_FIELD(revision, "0x%08x");
+    COMPARE_FIELD(header_size, "%i");
+    COMPARE_FIELD(my_lba, "%Li");
+    COMPARE_FIELD(alternate_lba, "%Li");
+    COMPARE_FIELD(first_usable_lba, "%Li");
+    COMPARE_FIELD(last_usable_lba, "%Li");
+    COMPARE_FIELD(partition_entry_lba, "%Li");
+    COMPARE_FIELD(number_of_partition_entries, "%i");
+    COMPARE_FIELD(size_of_partition_entry, "%i");
+    COMPARE_FIELD(partition_entry_array_crc32, "0x%08x");
+#undef COMPARE_FIELD
+
+    if(memcmp(a->disk_uuid, b->disk_uuid, sizeof(uuid))) {
+	uuid uuid_a, uuid_b;
+	swab_and_copy_uuid(&uuid_a, &a->disk_uuid);
+	swab_and_copy_uuid(&uuid_b, &b->disk_uuid);
+	printf("  Header disk_uuid: %s", uuid_to_ascii(uuid_a));
+	printf(" -> %s\n", uuid_to_ascii(uuid_b));
+	(*n_differences)++;
+    }
+}
+
+
+static void compare_entries(lba index, struct partition_entry *a, struct partition_entry *b,
+			    lba *n_differences) {
+    lba n_before = *n_differences;
+
+    if(memcmp(a->partition_type_uuid, b->partition_type_uuid, sizeof(uuid))) {
+	uuid uuid_a, uuid_b;
+	swab_and_copy_uuid(&uuid_a, &a->partition_type_uuid);
+	swab_and_copy_uuid(&uuid_b, &b->partition_type_uuid);
+	char *name_a = get_type_uuid_name(uuid_a);
+	char *name_b = get_type_uuid_name(uuid_b);
+	printf("  Entry %Li partition_type_uuid: %s", index, uuid_to_ascii(uuid_a));
+	printf(" -> %s\n", uuid_to_ascii(uuid_b));
+	if(name_a || name_b)
+	    printf("    (%s -> %s)\n", name_a ? name_a : "unknown", name_b ? name_b : "unknown");
+	(*n_differences)++;
+    }
+
+    if(memcmp(a->unique_partition_uuid, b->unique_partition_uuid, sizeof(uuid))) {
+	uuid uuid_a, uuid_b;
+	swab_and_copy_uuid(&uuid_a, &a->unique_partition_uuid);
+	swab_and_copy_uuid(&uuid_b, &b->unique_partition_uuid);
+	printf("  Entry %Li unique_partition_uuid: %s", index, uuid_to_ascii(uuid_a));
+	printf(" -> %s\n", uuid_to_ascii(uuid_b));
+	(*n_differences)++;
+    }
+
+#define COMPARE_FIELD(field, format)					\
+    if(a->field != b->field) {						\
+	printf("  Entry %Li " #field ": " format " -> " format "\n",	\
+	       index, a->field, b->field);				\
+	(*n_differences)++;						\
+    }
+
+    COMPARE_FIELD(starting_lba, "%Li");
+    COMPARE_FIELD(ending_lba, "%Li");
+    COMPARE_FIELD(attributes, "0x%016Lx");
+#undef COMPARE_FIELD
+
+    if(memcmp(a->partition_name, b->partition_name, sizeof(a->partition_name))) {
+	char name_a[NAME_UTF8_SIZE], name_b[NAME_UTF8_SIZE];
+	decode_partition_name(a->partition_name, name_a);
+	decode_partition_name(b->partition_name, name_b);
+	printf("  Entry %Li partition_name: \"%s\" -> \"%s\"\n", index, name_a, name_b);
+	(*n_differences)++;
+    }
+
+    // Whatever's left is past the structure, in an oversized entry.
+    if(*n_differences == n_before) {
+	printf("  Entry %Li differs in its bytes past the standard fields.\n", index);
+	(*n_differences)++;
+    }
+}
+
+
+static void start_entry_stream(struct entry_stream *stream, int fd,
+			       struct gpt_header *header) {
+    stream->fd = fd;
+    stream->header = header;
+    stream->offset = header->partition_entry_lba * sizeof(block);
+    stream->n_unread = header->number_of_partition_entries;
+    stream->n_buffered = 0;
+    stream->next = 0;
+    stream->crc32 = 0xFFFFFFFF;
+    stream->failed = false;
+    stream->buffer = malloc((size_t) ENTRIES_PER_READ * header->size_of_partition_entry);
+}
+
+
+// Hands back each entry in turn, reading ahead a chunk at a time and keeping the array's
+// CRC32 as it goes; NULL once the array is used up, or if it can't be read, in which case
+// failed is set too.
+static uint8_t *next_entry(struct entry_stream *stream) {
+    size_t size = stream->header->size_of_partition_entry;
+
+    if(stream->next == stream->n_buffered) {
+	if(!stream->n_unread) return NULL;
+
+	uint32_t n = stream->n_unread;
+	if(n > ENTRIES_PER_READ) n = ENTRIES_PER_READ;
+	if(!try_read_bytes(stream->fd, stream->offset, stream->buffer, n * size)) {
+	    stream->failed = true;
+	    return NULL;
+	}
+	stream->crc32 = efi_crc32_continue(stream->buffer, n * size, stream->crc32);
+
+	stream->offset += n * size;
+	stream->n_unread -= n;
+	stream->n_buffered = n;
+	stream->next = 0;
+    }
+
+    return stream->buffer + (stream->next++) * size;
+}
+
+
+// FNV-1a.  Zero is kept to mean "empty slot", so a real entry never hashes to it.
+static uint64_t hash_entry(uint8_t *entry, uint32_t size) {
+    uint64_t hash = 0xcbf29ce484222325;
+    uint32_t i;
+    for(i = 0; i < size; i++) {
+	hash ^= entry[i];
+	hash *= 0x100000001b3;
+    }
+    return hash ? hash : 1;
+}
+
+
+static bool entry_is_empty(uint8_t *entry, uint32_t size) {
+    uint32_t i;
+    for(i = 0; i < size; i++)
+	if(entry[i]) return false;
+    return true;
+}
+
+
+// A missing entry counts as an empty one, and the shorter entry as though zero-padded.
+static bool entries_equal(uint8_t *a, uint32_t size_a, uint8_t *b, uint32_t size_b) {
+    if(!a) return !b || entry_is_empty(b, size_b);
+    if(!b) return entry_is_empty(a, size_a);
+
+    if(size_a > size_b) return entries_equal(b, size_b, a, size_a);
+    return !memcmp(a, b, size_a) && entry_is_empty(b + size_a, size_b - size_a);
+}
@@ -109,9 +109,12 @@ static const uint32_t crc32_tab[] = {
 
 
 uint32_t efi_crc32(uint8_t *buf, size_t len) {
+    STATS_PHASE_BEGIN(PHASE_EFI_CRC32);
     uint32_t v;
     v = efi_crc32_start(buf, len);
-    return efi_crc32_end(v);
+    v = efi_crc32_end(v);
+    STATS_PHASE_END(PHASE_EFI_CRC32);
+    return v;
 }
 
 uint32_t efi_crc32_start(uint8_t *buf, size_t len) {
@@ -128,6 +131,7 @@ uint32_t efi_crc32_continue(uint8_t *buf, size_t len, uint32_t seed) {
 	    crc32_tab[(crc32val ^ buf[i]) & 0xff] ^
 	    (crc32val >> 8);
     }
+    STATS_COUNT(COUNTER_CRC_BYTES, len);
     return crc32val;
 }
 
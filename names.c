@@ -0,0 +1,208 @@
+#include "tweak.h"
+
+#include <fnmatch.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define NAME_UNITS 36
+
+
+static bool partition_name_is_literal(char *pattern);
+
+
+static inline uint16_t get_name_unit(uint8_t *name, int i) {
+    return name[2*i] | (name[2*i+1] << 8);
+}
+
+
+static inline void put_name_unit(uint8_t *name, int i, uint16_t unit) {
+    name[2*i] = unit & 0xFF;
+    name[2*i+1] = unit >> 8;
+}
+
+
+// Decodes the 72-byte name field into NUL-terminated UTF-8, stopping at the first NUL unit.
+// Unpaired surrogates come out as U+FFFD rather than as an error, since there's no point
+// refusing to show somebody a name just because whoever wrote it was sloppy.
+size_t decode_partition_name(uint8_t *name, char *utf8) {
+    char *out = utf8;
+    int i = 0;
+
+    while(i < NAME_UNITS) {
+#ifdef __SSE2__
+	// Eight units at once, for as long as they're all nonzero ASCII - which is nearly
+	// always, in practice.
+	if(i + 8 <= NAME_UNITS) {
+	    __m128i zero = _mm_setzero_si128();
+	    __m128i units = _mm_loadu_si128((__m128i *) (name + 2*i));
+	    __m128i high_bits = _mm_and_si128(units, _mm_set1_epi16(0xFF80));
+	    int ascii = _mm_movemask_epi8(_mm_cmpeq_epi16(high_bits, zero)) == 0xFFFF;
+	    int nul = _mm_movemask_epi8(_mm_cmpeq_epi16(units, zero));
+	    if(ascii && !nul) {
+		_mm_storel_epi64((__m128i *) out, _mm_packus_epi16(units, units));
+		out += 8;
+		i += 8;
+		continue;
+	    }
+	}
+#endif
+
+	uint32_t c = get_name_unit(name, i++);
+	if(c == 0) break;
+
+	if(c >= 0xD800 && c < 0xDC00 && i < NAME_UNITS) {
+	    uint16_t low = get_name_unit(name, i);
+	    if(low >= 0xDC00 && low < 0xE000) {
+		c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+		i++;
+	    } else c = 0xFFFD;
+	} else if(c >= 0xD800 && c < 0xE000) c = 0xFFFD;
+
+	if(c < 0x80) {
+	    *out++ = c;
+	} else if(c < 0x800) {
+	    *out++ = 0xC0 | (c >> 6);
+	    *out++ = 0x80 | (c & 0x3F);
+	} else if(c < 0x10000) {
+	    *out++ = 0xE0 | (c >> 12);
+	    *out++ = 0x80 | ((c >> 6) & 0x3F);
+	    *out++ = 0x80 | (c & 0x3F);
+	} else {
+	    *out++ = 0xF0 | (c >> 18);
+	    *out++ = 0x80 | ((c >> 12) & 0x3F);
+	    *out++ = 0x80 | ((c >> 6) & 0x3F);
+	    *out++ = 0x80 | (c & 0x3F);
+	}
+    }
+
+    *out = '\0';
+    return out - utf8;
+}
+
+
+// Encodes UTF-8 into the 72-byte name field, zero-padded.  Returns false, leaving the field
+// untouched, if the input isn't valid UTF-8 or doesn't fit in 36 units.
+bool encode_partition_name(char *utf8, uint8_t *name) {
+    uint8_t *in = (uint8_t *) utf8;
+    size_t length = strlen(utf8);
+    uint8_t encoded[NAME_UNITS * 2];
+    bzero(encoded, sizeof(encoded));
+
+    int i = 0;
+    size_t position = 0;
+    while(position < length) {
+#ifdef __SSE2__
+	// Sixteen bytes of ASCII just get zero-extended into sixteen units.
+	if(position + 16 <= length && i + 16 <= NAME_UNITS) {
+	    __m128i bytes = _mm_loadu_si128((__m128i *) (in + position));
+	    if(!_mm_movemask_epi8(bytes)) {
+		__m128i zero = _mm_setzero_si128();
+		_mm_storeu_si128((__m128i *) (encoded + 2*i),
+				 _mm_unpacklo_epi8(bytes, zero));
+		_mm_storeu_si128((__m128i *) (encoded + 2*i + 16),
+				 _mm_unpackhi_epi8(bytes, zero));
+		i += 16;
+		position += 16;
+		continue;
+	    }
+	}
+#endif
+
+	uint32_t c = in[position++];
+	int n_continuation;
+	uint32_t minimum;
+	if(c < 0x80) {
+	    n_continuation = 0;
+	    minimum = 0;
+	} else if((c & 0xE0) == 0xC0) {
+	    c &= 0x1F;
+	    n_continuation = 1;
+	    minimum = 0x80;
+	} else if((c & 0xF0) == 0xE0) {
+	    c &= 0x0F;
+	    n_continuation = 2;
+	    minimum = 0x800;
+	} else if((c & 0xF8) == 0xF0) {
+	    c &= 0x07;
+	    n_continuation = 3;
+	    minimum = 0x10000;
+	} else return false;
+
+	for(; n_continuation > 0; n_continuation--) {
+	    if(position >= length || (in[position] & 0xC0) != 0x80) return false;
+	    c = (c << 6) | (in[position++] & 0x3F);
+	}
+	if(c < minimum || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)) return false;
+
+	if(c >= 0x10000) {
+	    if(i + 2 > NAME_UNITS) return false;
+	    c -= 0x10000;
+	    put_name_unit(encoded, i++, 0xD800 | (c >> 10));
+	    put_name_unit(encoded, i++, 0xDC00 | (c & 0x3FF));
+	} else {
+	    if(i + 1 > NAME_UNITS) return false;
+	    put_name_unit(encoded, i++, c);
+	}
+    }
+
+    memcpy(name, encoded, sizeof(encoded));
+    return true;
+}
+
+
+// Prints every in-use entry whose name matches the fnmatch(3) pattern, as
+// device:index: name.  If new_name is given (already encoded), those entries are renamed
+// and the table is committed.  Names are matched as UTF-8 in the locale main sets up, so
+// ? and [...] take whole characters.
+bool search_names(int fd, char *devicename, char *pattern, uint8_t *new_name) {
+    block header_block;
+    block *entry_blocks = load_table(fd, &header_block);
+    if(!entry_blocks) return false;
+
+    struct gpt_header *header = (struct gpt_header *) &header_block;
+
+    // A pattern without any wildcards can be encoded once and compared against the raw
+    // field, up to and including its terminator, without decoding anything.
+    uint8_t literal[NAME_UNITS * 2];
+    size_t literal_size = 0;
+    if(partition_name_is_literal(pattern) && encode_partition_name(pattern, literal)) {
+	for(literal_size = 0; literal_size < sizeof(literal); literal_size += 2)
+	    if(!get_name_unit(literal, literal_size / 2)) break;
+	if(literal_size < sizeof(literal)) literal_size += 2;
+    }
+
+    char name[NAME_UTF8_SIZE];
+    lba i, n_matches = 0;
+    for(i = 0; i < header->number_of_partition_entries; i++) {
+	struct partition_entry *entry = get_partition_entry(header, entry_blocks, i);
+	if(entry_is_unused(entry)) continue;
+
+	if(literal_size) {
+	    if(memcmp(entry->partition_name, literal, literal_size)) continue;
+	    strcpy(name, pattern);
+	} else {
+	    decode_partition_name(entry->partition_name, name);
+	    if(fnmatch(pattern, name, 0)) continue;
+	}
+
+	n_matches++;
+	if(new_name) {
+	    memcpy(entry->partition_name, new_name, sizeof(entry->partition_name));
+	    char renamed[NAME_UTF8_SIZE];
+	    decode_partition_name(entry->partition_name, renamed);
+	    printf("%s:%Li: %s -> %s\n", devicename, i, name, renamed);
+	} else printf("%s:%Li: %s\n", devicename, i, name);
+    }
+
+    bool result = true;
+    if(new_name && n_matches) result = commit_table(&header_block, entry_blocks);
+
+    free(entry_blocks);
+    return result;
+}
+
+
+static bool partition_name_is_literal(char *pattern) {
+    return !strpbrk(pattern, "*?[\\");
+}
@@ -0,0 +1,189 @@
+#include "tweak.h"
+
+#ifdef TWEAK_STATS
+
+#include <pthread.h>
+#include <time.h>
+
+
+// Everything in here is deliberately dumb: fixed arrays of totals, one slot per device
+// name, summed up only when somebody asks for a report.  Phase times are inclusive, so
+// validate_gpt_header's time also contains the efi_crc32 time it caused.  Each thread has
+// its own current device, and the slots never move once made, so threads working on
+// different devices don't get in each other's way.
+
+char *stats_phase_names[N_STATS_PHASES] = {
+    "open",
+    "read_block",
+    "efi_crc32",
+    "validate_gpt_header",
+    "validate_entry_array",
+    "write_block"
+};
+
+char *stats_counter_names[N_STATS_COUNTERS] = {
+    "bytes_read",
+    "bytes_written",
+    "syscalls",
+    "crc_bytes",
+    "entries_decoded",
+    "cache_hits"
+};
+
+struct device_stats {
+    char *name;
+    uint64_t phase_ns[N_STATS_PHASES];
+    uint64_t phase_calls[N_STATS_PHASES];
+    uint64_t counters[N_STATS_COUNTERS];
+};
+
+static struct device_stats **all_stats = NULL;
+static int n_all_stats = 0;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct device_stats *current_stats = NULL;
+
+static void sum_stats(struct device_stats *total);
+static void print_prometheus_series(FILE *out, char *metric, char *device,
+				    char *phase, char *format, ...);
+
+
+uint64_t stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+void stats_begin_device(char *name) {
+    pthread_mutex_lock(&all_stats_lock);
+
+    int i;
+    for(i = 0; i < n_all_stats; i++)
+	if(!strcmp(all_stats[i]->name, name)) break;
+
+    if(i == n_all_stats) {
+	all_stats = realloc(all_stats, (n_all_stats + 1) * sizeof(struct device_stats *));
+	all_stats[n_all_stats] = calloc(1, sizeof(struct device_stats));
+	all_stats[n_all_stats]->name = name;
+	n_all_stats++;
+    }
+    current_stats = all_stats[i];
+
+    pthread_mutex_unlock(&all_stats_lock);
+}
+
+
+void stats_add_phase(enum stats_phase phase, uint64_t ns) {
+    if(!current_stats) return;
+    current_stats->phase_ns[phase] += ns;
+    current_stats->phase_calls[phase]++;
+}
+
+
+void stats_add_counter(enum stats_counter counter, uint64_t n) {
+    if(!current_stats) return;
+    current_stats->counters[counter] += n;
+}
+
+
+void stats_print_summary(FILE *out) {
+    struct device_stats total;
+    sum_stats(&total);
+
+    int i, j;
+    for(i = -1; i < n_all_stats; i++) {
+	struct device_stats *stats = (i == -1) ? &total : all_stats[i];
+	if(i == -1) {
+	    if(n_all_stats < 2) continue;
+	    fprintf(out, "\nTotals over %i devices:\n", n_all_stats);
+	} else fprintf(out, "\nTimings for %s:\n", stats->name);
+
+	for(j = 0; j < N_STATS_PHASES; j++) {
+	    if(!stats->phase_calls[j]) continue;
+	    fprintf(out, "  %-22s %8Li calls %12.3f ms\n",
+		    stats_phase_names[j], stats->phase_calls[j],
+		    stats->phase_ns[j] / 1e6);
+	}
+	for(j = 0; j < N_STATS_COUNTERS; j++)
+	    fprintf(out, "  %-22s %8Li\n", stats_counter_names[j], stats->counters[j]);
+    }
+}
+
+
+int stats_write_prometheus(char *filename) {
+    FILE *out = fopen(filename, "w");
+    if(!out) {
+	fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+	return 0;
+    }
+
+    int i, j;
+    fprintf(out, "# HELP gpt_tweak_phase_seconds_total "
+	    "Inclusive wall-clock time spent in each phase.\n");
+    fprintf(out, "# TYPE gpt_tweak_phase_seconds_total counter\n");
+    for(i = 0; i < n_all_stats; i++)
+	for(j = 0; j < N_STATS_PHASES; j++)
+	    print_prometheus_series(out, "gpt_tweak_phase_seconds_total",
+				    all_stats[i]->name, stats_phase_names[j], "%.9f",
+				    all_stats[i]->phase_ns[j] / 1e9);
+
+    fprintf(out, "# HELP gpt_tweak_phase_calls_total "
+	    "Number of times each phase was entered.\n");
+    fprintf(out, "# TYPE gpt_tweak_phase_calls_total counter\n");
+    for(i = 0; i < n_all_stats; i++)
+	for(j = 0; j < N_STATS_PHASES; j++)
+	    print_prometheus_series(out, "gpt_tweak_phase_calls_total",
+				    all_stats[i]->name, stats_phase_names[j], "%Li",
+				    all_stats[i]->phase_calls[j]);
+
+    for(j = 0; j < N_STATS_COUNTERS; j++) {
+	char metric[64];
+	snprintf(metric, sizeof(metric), "gpt_tweak_%s_total", stats_counter_names[j]);
+	fprintf(out, "# TYPE %s counter\n", metric);
+	for(i = 0; i < n_all_stats; i++)
+	    print_prometheus_series(out, metric, all_stats[i]->name, NULL, "%Li",
+				    all_stats[i]->counters[j]);
+    }
+
+    fclose(out);
+    return 1;
+}
+
+
+static void sum_stats(struct device_stats *total) {
+    bzero(total, sizeof(struct device_stats));
+
+    int i, j;
+    for(i = 0; i < n_all_stats; i++) {
+	for(j = 0; j < N_STATS_PHASES; j++) {
+	    total->phase_ns[j] += all_stats[i]->phase_ns[j];
+	    total->phase_calls[j] += all_stats[i]->phase_calls[j];
+	}
+	for(j = 0; j < N_STATS_COUNTERS; j++)
+	    total->counters[j] += all_stats[i]->counters[j];
+    }
+}
+
+
+static void print_prometheus_series(FILE *out, char *metric, char *device,
+				    char *phase, char *format, ...) {
+    fprintf(out, "%s{device=\"", metric);
+    // Label values need their backslashes, quotes and newlines escaped.
+    char *c;
+    for(c = device; *c; c++) {
+	if(*c == '\\' || *c == '"') fprintf(out, "\\%c", *c);
+	else if(*c == '\n') fprintf(out, "\\n");
+	else fputc(*c, out);
+    }
+    fprintf(out, "\"");
+    if(phase) fprintf(out, ",phase=\"%s\"", phase);
+    fprintf(out, "} ");
+
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(out, format, ap);
+    va_end(ap);
+    fprintf(out, "\n");
+}
+
+#endif
@@ -1,49 +1,9 @@
 #include "tweak.h"
 
-#define true 1
-#define false 0
-typedef uint8_t bool;
-typedef uint8_t block[512];
-typedef uint8_t uuid[16];
-typedef uint64_t lba;
-
-struct uuid {
-    uint32_t time_low; // Little-endian.
-    uint16_t time_mid; // Little-endian.
-    uint16_t time_high_and_version; // Little-endian.
-    uint8_t clock_seq_high_and_reserved;
-    uint8_t clock_seq_low;
-    uint8_t node[6];
-};
-
-struct gpt_header {
-    char signature[8];
-    uint32_t revision;
-    uint32_t header_size; // must be >= 92
-    uint32_t header_crc32;
-    // assume this field zero then compute over the first header_size bytes
-    uint32_t reserved; // must be zero
-    lba my_lba;
-    lba alternate_lba;
-    lba first_usable_lba;
-    lba last_usable_lba;
-    uuid disk_uuid;
-    lba partition_entry_lba;
-    uint32_t number_of_partition_entries;
-    uint32_t size_of_partition_entry; // must be a multiple of 8
-    uint32_t partition_entry_array_crc32;
-    // computed over number_of_partition_entries * size_of_partition_entry bytes
-    // Remaining bytes must all be zero.
-};
-
-struct partition_entry {
-    uuid partition_type_uuid;
-    uuid unique_partition_uuid;
-    lba starting_lba;
-    lba ending_lba;
-    uint64_t attributes;
-    uint8_t partition_name[72];
-};
+#include <linux/fs.h>
+#include <locale.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 
 struct predefined_type_uuid {
     uuid uuid;
@@ -91,36 +51,46 @@ struct predefined_type_uuid predefined_type_uuids[] = {
       "Empty partition" }
 };
 
-void tweak(int fd);
-void read_block(int fd, lba lba, block *data);
-void write_block(lba lba, block *data);
-void hexdump_block(block *data);
-char *uuid_to_ascii(uuid uuid);
-bool validate_gpt_header(block *header, lba expected_lba);
-block *load_entry_array(int fd, struct gpt_header *header);
-bool validate_entry_array(struct gpt_header *header, block *entry_blocks);
-struct partition_entry *get_partition_entry(struct gpt_header *header,
-					    block *entry_blocks, lba index);
-void overwrite_entry_name_ascii(struct partition_entry *entry, char *ascii);
-uint32_t compute_header_crc32(block *header);
-uint32_t compute_entry_crc32(struct gpt_header *header, block *entry_blocks);
-uint64_t total_entry_size(struct gpt_header *header);
-char *get_type_uuid_name(uuid uuid);
-uuid *get_type_name_uuid(char *to_be_found);
-void swab_and_copy_uuid(uuid *target, uuid *source);
-void swab_uuid(uuid *uuid);
-void swab32(uint8_t *bytes);
-void swab16(uint8_t *bytes);
+// When several devices are worked on in one go, their output files get this prefixed.
+int output_device_index = 0;
+
+// Beyond these, a header is describing something no real disk has, and believing it would
+// mean allocating and reading absurd amounts.
+#define MAX_ENTRY_SIZE 4096
+#define MAX_ENTRY_ARRAY_SIZE (4 * 1024 * 1024)
+
+// Whether tables with the canonical geometry get the specialized code; see tweak.h.
+bool canonical_fast_path = true;
+
+static bool validate_gpt_header_of_size(block *header_block, lba expected_lba,
+					uint32_t header_size);
+static bool validate_entry_array_of_geometry(struct gpt_header *header, block *entry_blocks,
+					     uint32_t n_entries, uint32_t entry_size);
+static uint32_t compute_header_crc32_of_size(block *header_block, size_t size_to_checksum);
 
 
 
 int main(int argc, char **argv) {
+    // Partition names are decoded to UTF-8, so name patterns need a UTF-8 locale for ? and
+    // [...] to match characters rather than bytes.  Whatever the environment says is the
+    // fallback if C.UTF-8 isn't available.
+    if(!setlocale(LC_CTYPE, "C.UTF-8")) setlocale(LC_CTYPE, "");
+
     cutoff_detail = 9;
     describe_failures = true;
     describe_successes = true;
     describe_trivia = true;
 
-    char *devicename = NULL;
+    char **devicenames = malloc(argc * sizeof(char *));
+    int n_devicenames = 0;
+    bool print_stats = false;
+    char *stats_filename = NULL;
+    char *search_pattern = NULL;
+    char *rename_to = NULL;
+    bool diff_mode = false;
+    bool clone_mode = false;
+    char *socket_path = NULL;
+    int n_benchmark_iterations = 0;
 
     bool usage_okay = true;
     int i;
@@ -138,39 +108,139 @@ int main(int argc, char **argv) {
 		case 's': describe_successes = false; break;
 		case 'T': describe_trivia = true; break;
 		case 't': describe_trivia = false; break;
+		case 'm': print_stats = true; break;
+		case 'd': diff_mode = true; break;
+		case 'c': clone_mode = true; break;
+		case 'M':
+		case 'n':
+		case 'r':
+		case 'D':
+		case 'b':
+		    if(i + 1 >= argc) usage_okay = false;
+		    else if(c == 'M') stats_filename = argv[++i];
+		    else if(c == 'n') search_pattern = argv[++i];
+		    else if(c == 'r') rename_to = argv[++i];
+		    else if(c == 'D') socket_path = argv[++i];
+		    else if((n_benchmark_iterations = atoi(argv[++i])) <= 0) usage_okay = false;
+		    break;
 		default: usage_okay = false; break;
 		}
+		if(c == 'M' || c == 'n' || c == 'r' || c == 'D' || c == 'b') break;
 	    }
-	} else if(!devicename) {
-	    devicename = argv[i];
 	} else {
-	    usage_okay = false;
+	    devicenames[n_devicenames++] = argv[i];
 	}
     }
-    if(!devicename) usage_okay = false;
+    if(!n_devicenames) usage_okay = false;
+    if(rename_to && !search_pattern) usage_okay = false;
+    if(diff_mode && (search_pattern || n_devicenames % 2)) usage_okay = false;
+    if(clone_mode && (diff_mode || search_pattern || n_devicenames < 2)) usage_okay = false;
+    if(socket_path && (clone_mode || diff_mode || search_pattern)) usage_okay = false;
+    if(n_benchmark_iterations
+       && (socket_path || clone_mode || diff_mode || search_pattern))
+	usage_okay = false;
     if(!usage_okay) {
-	fprintf(stderr, "Usage: gpt-tweak [-fstFST0123456789] device|file\n");
+	fprintf(stderr, "Usage: gpt-tweak [-fstmFST0123456789] [-M metrics-file] "
+		"[-n name-pattern [-r new-name]] device|file...\n"
+		"       gpt-tweak -d [-fstmFST0123456789] [-M metrics-file] "
+		"old new [old new]...\n"
+		"       gpt-tweak -c [-fstmFST0123456789] [-M metrics-file] "
+		"template target...\n"
+		"       gpt-tweak -D socket-path [-fstmFST0123456789] [-M metrics-file] "
+		"device|file...\n"
+		"       gpt-tweak -b iterations [-fstmFST0123456789] [-M metrics-file] "
+		"device|file...\n");
 	return 1;
     }
 
+    uint8_t encoded_rename_to[sizeof(((struct partition_entry *) 0)->partition_name)];
+    if(rename_to && !encode_partition_name(rename_to, encoded_rename_to)) {
+	fprintf(stderr, "The name \"%s\" isn't UTF-8 or is too long for an entry.\n",
+		rename_to);
+	return 1;
+    }
+#ifndef TWEAK_STATS
+    if(print_stats || stats_filename)
+	fprintf(stderr, "This gpt-tweak was built without STATS=1, so there are no "
+		"measurements to report.\n");
+#endif
+
     printf("Okay, my verbosity is -%c%c%c%i.  Just so you know.\n",
 	   describe_failures ? 'F' : 'f',
 	   describe_successes ? 'S' : 's',
 	   describe_trivia ? 'T' : 't',
 	   cutoff_detail);
     current_detail = 1;
-    
-    int fd = open64(devicename, O_RDONLY);
-    if(fd == -1) {
-	fprintf(stderr, "Unable to open %s: %s\n", devicename, strerror(errno));
-	return 1;
+
+    int result = 0;
+    if(socket_path) {
+	if(!serve_tables(socket_path, devicenames, n_devicenames)) result = 1;
+    } else if(clone_mode) {
+	int fd = open_device(devicenames[0], O_RDONLY);
+	if(fd == -1) result = 1;
+	else {
+	    if(clone_table(fd, devicenames + 1, n_devicenames - 1)) result = 1;
+	    close(fd);
+	}
+    } else if(diff_mode) {
+	// Like diff(1): 0 if everything's the same, 1 if anything differs, 2 on trouble.
+	for(i = 0; i < n_devicenames; i += 2) {
+	    // The work on a pair gets counted against its first member.
+	    int fd_a = open_device(devicenames[i], O_RDONLY);
+	    int fd_b = open_device(devicenames[i+1], O_RDONLY);
+	    STATS_DEVICE(devicenames[i]);
+	    int difference = -1;
+	    if(fd_a != -1 && fd_b != -1)
+		difference = diff_tables(fd_a, devicenames[i], fd_b, devicenames[i+1]);
+	    if(difference == -1) result = 2;
+	    else if(difference && !result) result = 1;
+	    if(fd_a != -1) close(fd_a);
+	    if(fd_b != -1) close(fd_b);
+	}
+    } else for(i = 0; i < n_devicenames; i++) {
+	if(n_devicenames > 1) {
+	    printf("\nWorking on %s.\n", devicenames[i]);
+	    output_device_index = i + 1;
+	}
+
+	int fd = open_device(devicenames[i], O_RDONLY);
+	if(fd == -1) {
+	    result = 1;
+	    continue;
+	}
+
+	if(search_pattern) {
+	    if(!search_names(fd, devicenames[i], search_pattern,
+			     rename_to ? encoded_rename_to : NULL))
+		result = 1;
+	} else if(n_benchmark_iterations) {
+	    benchmark_table(fd, devicenames[i], n_benchmark_iterations);
+	} else tweak(fd);
+
+	close(fd);
+	STATS_COUNT(COUNTER_SYSCALLS, 1);
     }
 
-    tweak(fd);
+#ifdef TWEAK_STATS
+    if(print_stats) stats_print_summary(stdout);
+    if(stats_filename && !stats_write_prometheus(stats_filename)) result = 1;
+#endif
+
+    return result;
+}
+
+
+int open_device(char *devicename, int flags) {
+    STATS_DEVICE(devicename);
 
-    close(fd);
+    STATS_PHASE_BEGIN(PHASE_OPEN);
+    int fd = open64(devicename, flags);
+    STATS_COUNT(COUNTER_SYSCALLS, 1);
+    STATS_PHASE_END(PHASE_OPEN);
+    if(fd == -1)
+	fprintf(stderr, "Unable to open %s: %s\n", devicename, strerror(errno));
 
-    return 0;
+    return fd;
 }
 
 
@@ -182,26 +252,12 @@ void tweak(int fd) {
     hexdump_block(&legacy_mbr);
     */
 
-    printf("\nLoading the header.\n");
-    
     block header_block;
-    read_block(fd, 1, &header_block);
-    if(!validate_gpt_header(&header_block, 1)) {
-	describe_failure("The header doesn't validate.\n");
-	return;
-    } else describe_success("The header validates.\n");
+    block *entry_blocks = load_table(fd, &header_block);
+    if(!entry_blocks) return;
 
     struct gpt_header *header = (struct gpt_header *) &header_block;
 
-    printf("\nLoading the entry array.\n");
-
-    block *entry_blocks = load_entry_array(fd, header);
-
-    if(!validate_entry_array(header, entry_blocks)) {
-	describe_failure("The entry array doesn't validate.\n");
-	return;
-    } else describe_success("The entry array validates.\n");
-
     printf("\nPatching the entry array to my very specific requirements.\n");
 
     struct partition_entry *entry = get_partition_entry(header, entry_blocks, 1);
@@ -210,7 +266,7 @@ void tweak(int fd) {
 
     swab_and_copy_uuid(&entry->partition_type_uuid, new_uuid);
 
-    overwrite_entry_name_ascii(entry, "Crookshanks");
+    overwrite_entry_name(entry, "Crookshanks");
 
     entry = get_partition_entry(header, entry_blocks, 2);
     new_uuid = get_type_name_uuid("Basic data partition (could be Windows or Linux!)");
@@ -219,27 +275,66 @@ void tweak(int fd) {
     //describe_trivium("\nBy the way, basic data is    %s\n", uuid_to_ascii(new_uuid));
     //describe_trivium("By the way, HFS+ is          %s\n", uuid_to_ascii(new_uuid));
 
+    commit_table(&header_block, entry_blocks);
+    free(entry_blocks);
+}
+
+
+block *load_table(int fd, block *header_block) {
+    printf("\nLoading the header.\n");
+    
+    if(!try_read_block(fd, 1, header_block)) return NULL;
+    if(!validate_gpt_header(header_block, 1)) {
+	describe_failure("The header doesn't validate.\n");
+	return NULL;
+    } else describe_success("The header validates.\n");
+
+    struct gpt_header *header = (struct gpt_header *) header_block;
+
+    if(!entry_geometry_is_sane(fd, header)) {
+	describe_failure("The entry array can't be loaded.\n");
+	return NULL;
+    }
+
+    printf("\nLoading the entry array.\n");
+
+    block *entry_blocks = load_entry_array(fd, header);
+    if(!entry_blocks) return NULL;
+
+    if(!validate_entry_array(header, entry_blocks)) {
+	describe_failure("The entry array doesn't validate.\n");
+	free(entry_blocks);
+	return NULL;
+    } else describe_success("The entry array validates.\n");
+
+    return entry_blocks;
+}
+
+
+bool commit_table(block *header_block, block *entry_blocks) {
+    struct gpt_header *header = (struct gpt_header *) header_block;
+
     printf("\nPatching the checksums in the header, in effect accepting the changes.\n");
     uint32_t new_array_crc32 = compute_entry_crc32(header, entry_blocks);
     header->partition_entry_array_crc32 = new_array_crc32;
 
     if(!validate_entry_array(header, entry_blocks)) {
 	describe_failure("The patched entry array doesn't validate.\n");
-	return;
+	return false;
     } else describe_success("The patched entry array validates.\n");
 
-    uint32_t new_header_crc32 = compute_header_crc32(&header_block);
+    uint32_t new_header_crc32 = compute_header_crc32(header_block);
     header->header_crc32 = new_header_crc32;
 
-    if(!validate_gpt_header(&header_block, 1)) {
+    if(!validate_gpt_header(header_block, 1)) {
 	describe_failure("The patched header doesn't validate.\n");
-	return;
+	return false;
     } else describe_success("The patched header validates.\n");
 
     describe_trivium("\nCreating the patched backup header, based on the patched header.\n");
 
     block backup_header_block;
-    memcpy(&backup_header_block, &header_block, sizeof(block));
+    memcpy(&backup_header_block, header_block, sizeof(block));
     struct gpt_header *backup_header = (struct gpt_header *) backup_header_block;
     backup_header->my_lba = header->alternate_lba;
     backup_header->alternate_lba = header->my_lba;
@@ -248,35 +343,126 @@ void tweak(int fd) {
 
     if(!validate_gpt_header(&backup_header_block, header->alternate_lba)) {
 	describe_failure("The patched backup header doesn't validate.\n");
-	return;
+	return false;
     } else describe_success("The patched backup header validates.\n");
 
-    write_block(1, &header_block);
-    write_block(2, entry_blocks);
+    // Any entry might have changed, so all of the array goes out, not just its first block.
+    uint64_t size = total_entry_size(header);
+    lba n_entry_blocks = (size + sizeof(block) - 1) / sizeof(block);
+    lba i;
+
+    write_block(1, header_block);
+    for(i = 0; i < n_entry_blocks; i++)
+	write_block(header->partition_entry_lba + i, &entry_blocks[i]);
     write_block(header->alternate_lba, &backup_header_block);
+
+    return true;
 }
 
 
 void read_block(int fd, lba lba, block *data) {
+    if(!try_read_block(fd, lba, data)) exit(1);
+}
+
+
+// For callers that have something better to do with a bad read than give up entirely.
+bool try_read_block(int fd, lba lba, block *data) {
+    STATS_PHASE_BEGIN(PHASE_READ_BLOCK);
     ssize_t result = pread64(fd, data, sizeof(block), lba*sizeof(block));
+    STATS_COUNT(COUNTER_SYSCALLS, 1);
+    STATS_PHASE_END(PHASE_READ_BLOCK);
     if(result == -1) {
 	fprintf(stderr, "Unable to read LBA %Li: %s\n", lba, strerror(errno));
-	exit(1);
+	return false;
     }
     if(result != sizeof(block)) {
 	fprintf(stderr, "Inexplicably got wrong amount of bytes for LBA %Li\n", lba);
-	exit(1);
+	return false;
+    }
+    STATS_COUNT(COUNTER_BYTES_READ, result);
+    return true;
+}
+
+
+void read_bytes(int fd, uint64_t offset, void *data, size_t size) {
+    if(!try_read_bytes(fd, offset, data, size)) exit(1);
+}
+
+
+bool try_read_bytes(int fd, uint64_t offset, void *data, size_t size) {
+    STATS_PHASE_BEGIN(PHASE_READ_BLOCK);
+    ssize_t result = pread64(fd, data, size, offset);
+    STATS_COUNT(COUNTER_SYSCALLS, 1);
+    STATS_PHASE_END(PHASE_READ_BLOCK);
+    if(result == -1) {
+	fprintf(stderr, "Unable to read %li bytes at offset %Li: %s\n",
+		size, offset, strerror(errno));
+	return false;
+    }
+    if(result != size) {
+	fprintf(stderr, "Inexplicably got wrong amount of bytes at offset %Li\n", offset);
+	return false;
+    }
+    STATS_COUNT(COUNTER_BYTES_READ, result);
+    return true;
+}
+
+
+// Block devices don't have a size as far as stat is concerned, so they're asked directly.
+bool get_device_size(int fd, uint64_t *size) {
+    struct stat status;
+    if(fstat(fd, &status) == -1) {
+	fprintf(stderr, "Unable to stat the device: %s\n", strerror(errno));
+	return false;
+    }
+
+    if(S_ISBLK(status.st_mode)) {
+	if(ioctl(fd, BLKGETSIZE64, size) == -1) {
+	    fprintf(stderr, "Unable to get the size of the device: %s\n", strerror(errno));
+	    return false;
+	}
+    } else *size = status.st_size;
+
+    return true;
+}
+
+
+// Unlike write_block, this writes to the device itself, and leaves it to the caller to
+// decide what a failure means.
+bool write_bytes(int fd, uint64_t offset, void *data, size_t size) {
+    STATS_PHASE_BEGIN(PHASE_WRITE_BLOCK);
+    ssize_t result = pwrite64(fd, data, size, offset);
+    STATS_COUNT(COUNTER_SYSCALLS, 1);
+    if(result > 0) STATS_COUNT(COUNTER_BYTES_WRITTEN, result);
+    STATS_PHASE_END(PHASE_WRITE_BLOCK);
+
+    if(result == -1) {
+	fprintf(stderr, "Unable to write %li bytes at offset %Li: %s\n",
+		size, offset, strerror(errno));
+	return false;
+    }
+    if(result != size) {
+	fprintf(stderr, "Unable to write %li bytes at offset %Li, only wrote %li.\n",
+		size, offset, result);
+	return false;
     }
+    return true;
 }
 
 
 void write_block(lba output_lba, block *data) {
+    STATS_PHASE_BEGIN(PHASE_WRITE_BLOCK);
     char filename[64];
-    sprintf(filename, "new-%Li.lba", output_lba);
+    if(output_device_index)
+	sprintf(filename, "new-%i-%Li.lba", output_device_index, output_lba);
+    else
+	sprintf(filename, "new-%Li.lba", output_lba);
     
     int out_fd = open64(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    STATS_COUNT(COUNTER_SYSCALLS, 1);
     if(out_fd == -1) {
 	fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+	STATS_PHASE_END(PHASE_WRITE_BLOCK);
 	return;
     }
 
@@ -289,6 +475,9 @@ void write_block(lba output_lba, block *data) {
     }
     
     close(out_fd);
+    STATS_COUNT(COUNTER_SYSCALLS, 2);
+    if(result > 0) STATS_COUNT(COUNTER_BYTES_WRITTEN, result);
+    STATS_PHASE_END(PHASE_WRITE_BLOCK);
 
     printf("OKAY, you will find output in %s!\n", filename);
 }
@@ -346,6 +535,26 @@ char *uuid_to_ascii(uuid uuid) {
 
 
 bool validate_gpt_header(block *header_block, lba expected_lba) {
+    STATS_PHASE_BEGIN(PHASE_VALIDATE_GPT_HEADER);
+
+    struct gpt_header *header = (struct gpt_header *) header_block;
+    bool result;
+    if(canonical_fast_path && header->header_size == CANONICAL_HEADER_SIZE)
+	result = validate_gpt_header_of_size(header_block, expected_lba, CANONICAL_HEADER_SIZE);
+    else {
+	// Whatever the header claims, only one block of it was read.
+	uint32_t header_size = header->header_size;
+	if(header_size > sizeof(block)) header_size = sizeof(block);
+	result = validate_gpt_header_of_size(header_block, expected_lba, header_size);
+    }
+
+    STATS_PHASE_END(PHASE_VALIDATE_GPT_HEADER);
+    return result;
+}
+
+
+static inline __attribute__((always_inline))
+bool validate_gpt_header_of_size(block *header_block, lba expected_lba, uint32_t header_size) {
     current_detail++;
     
     struct gpt_header *header = (struct gpt_header *) header_block;
@@ -372,7 +581,7 @@ bool validate_gpt_header(block *header_block, lba expected_lba) {
     } else describe_success("Header self-LBA okay.\n");
 
     size_t i;
-    for(i = header->header_size; i < sizeof(block); i++)
+    for(i = header_size; i < sizeof(block); i++)
 	if((*header_block)[i] != 0x00) break;
     if(i != sizeof(block)) {
 	describe_failure("GPT header followed by trailing garbage at offset %li.\n", i);
@@ -380,7 +589,7 @@ bool validate_gpt_header(block *header_block, lba expected_lba) {
     } else describe_success("GPT header correctly followed by zeroes.\n");
 
     uint32_t old_header_crc32 = header->header_crc32;
-    uint32_t new_header_crc32 = compute_header_crc32(header_block);
+    uint32_t new_header_crc32 = compute_header_crc32_of_size(header_block, header_size);
 
     if(old_header_crc32 != new_header_crc32) {
 	describe_failure("Header's self-checksum is invalid.\n");
@@ -419,7 +628,19 @@ bool validate_gpt_header(block *header_block, lba expected_lba) {
 }
 
 
+// Returns NULL if any of the array can't be read.
 block *load_entry_array(int fd, struct gpt_header *header) {
+    if(canonical_fast_path && is_canonical_geometry(header)) {
+	block *entry_blocks = malloc(CANONICAL_ENTRY_ARRAY_SIZE);
+	if(!try_read_bytes(fd, CANONICAL_ENTRY_LBA * sizeof(block), entry_blocks,
+			   CANONICAL_ENTRY_ARRAY_SIZE))
+	{
+	    free(entry_blocks);
+	    return NULL;
+	}
+	return entry_blocks;
+    }
+
     uint64_t size = total_entry_size(header);
     lba first_entry_block = header->partition_entry_lba;
     lba last_full_entry_block = header->partition_entry_lba + size / sizeof(block) - 1;
@@ -433,11 +654,17 @@ block *load_entry_array(int fd, struct gpt_header *header) {
 	entry_lba <= last_full_entry_block;
 	entry_lba++, i++)
 	{
-	    read_block(fd, entry_lba, &(entry_blocks[i]));
+	    if(!try_read_block(fd, entry_lba, &(entry_blocks[i]))) {
+		free(entry_blocks);
+		return NULL;
+	    }
 	}
     if(size % sizeof(block) != 0) {
 	describe_trivium("There's a last odd block in the entry array, of size %Li.\n");
-	read_block(fd, entry_lba, &(entry_blocks[i]));
+	if(!try_read_block(fd, entry_lba, &(entry_blocks[i]))) {
+	    free(entry_blocks);
+	    return NULL;
+	}
     }
 
     return entry_blocks;
@@ -445,26 +672,52 @@ block *load_entry_array(int fd, struct gpt_header *header) {
 
 
 bool validate_entry_array(struct gpt_header *header, block *entry_blocks) {
+    STATS_PHASE_BEGIN(PHASE_VALIDATE_ENTRY_ARRAY);
+
+    bool result;
+    if(canonical_fast_path && is_canonical_geometry(header))
+	result = validate_entry_array_of_geometry(header, entry_blocks, CANONICAL_N_ENTRIES,
+						  CANONICAL_ENTRY_SIZE);
+    else
+	result = validate_entry_array_of_geometry(header, entry_blocks,
+						  header->number_of_partition_entries,
+						  header->size_of_partition_entry);
+
+    STATS_PHASE_END(PHASE_VALIDATE_ENTRY_ARRAY);
+    return result;
+}
+
+
+static inline __attribute__((always_inline))
+bool validate_entry_array_of_geometry(struct gpt_header *header, block *entry_blocks,
+				      uint32_t n_entries, uint32_t entry_size) {
     current_detail++;
     
     bool result = true;
     
-    if(compute_entry_crc32(header, entry_blocks) != header->partition_entry_array_crc32) {
+    if(efi_crc32((uint8_t *) entry_blocks, (uint64_t) n_entries * entry_size)
+       != header->partition_entry_array_crc32)
+    {
 	describe_failure("The entry array CRC32 doesn't validate.\n");
 	result = false;
     } else describe_success("The entry array CRC32 validates.\n");
 
     lba n_zero_entries = 0;
     lba i;
-    for(i = 0; i < header->number_of_partition_entries; i++) {
-	struct partition_entry *entry = get_partition_entry(header, entry_blocks, i);
+    for(i = 0; i < n_entries; i++) {
+	struct partition_entry *entry
+	    = (struct partition_entry *) ((uint8_t *) entry_blocks + i * entry_size);
 	lba j;
-	for(j = 0; j < header->size_of_partition_entry; j++)
+	for(j = 0; j < entry_size; j++)
 	    if(((uint8_t *) entry)[j] != 0) break;
-	if(j == header->size_of_partition_entry) {
+	if(j == entry_size) {
 	    n_zero_entries++;
 	    continue;
 	}
+	STATS_COUNT(COUNTER_ENTRIES_DECODED, 1);
+
+	// Nothing below is anything but description, and some of it is expensive.
+	if(!describe_trivia || current_detail > cutoff_detail) continue;
 
 	uuid type_uuid, partition_uuid;
 	swab_and_copy_uuid(&type_uuid, &entry->partition_type_uuid);
@@ -481,7 +734,9 @@ bool validate_entry_array(struct gpt_header *header, block *entry_blocks) {
 	describe_trivium("  From lba %Li to %Li, attributes 0x%016Lx.\n",
 			 entry->starting_lba, entry->ending_lba,
 			 entry->attributes);
-	describe_trivium("  And it has a name, too.\n");
+	char name[NAME_UTF8_SIZE];
+	decode_partition_name(entry->partition_name, name);
+	describe_trivium("  And it has a name, too: \"%s\".\n", name);
     }
     describe_trivium("There are a total of %Li entries which are just zeroes.\n",
 		     n_zero_entries);
@@ -498,26 +753,73 @@ struct partition_entry *get_partition_entry(struct gpt_header *header,
 }
 
 
-void overwrite_entry_name_ascii(struct partition_entry *entry, char *ascii) {
-    bzero(&entry->partition_name, sizeof(entry->partition_name));
+// A header can validate and still describe an entry array that can't be loaded: entries
+// too small or oddly sized, an array of absurd size, or one that runs off the device.
+bool entry_geometry_is_sane(int fd, struct gpt_header *header) {
+    uint32_t entry_size = header->size_of_partition_entry;
+    if(entry_size < sizeof(struct partition_entry) || entry_size % 8 != 0
+       || entry_size > MAX_ENTRY_SIZE)
+    {
+	describe_failure("Entries of %i bytes aren't something I can work with.\n", entry_size);
+	return false;
+    }
 
-    int i;
-    for(i = 0; ascii[i]; i++)
-	entry->partition_name[2*i] = ascii[i];
+    uint64_t size = (uint64_t) header->number_of_partition_entries * entry_size;
+    if(size > MAX_ENTRY_ARRAY_SIZE) {
+	describe_failure("An entry array of %Li bytes is too big to believe.\n", size);
+	return false;
+    }
+
+    uint64_t device_size;
+    if(!get_device_size(fd, &device_size)) return false;
+    if(header->partition_entry_lba > device_size / sizeof(block)
+       || header->partition_entry_lba * sizeof(block) + size > device_size)
+    {
+	describe_failure("The entry array at LBA %Li runs past the end of the device.\n",
+			 header->partition_entry_lba);
+	return false;
+    }
+
+    return true;
 }
 
 
-uint32_t compute_header_crc32(block *header_block) {
-    block header_copy;
-    memcpy(&header_copy, header_block, sizeof(block));
-    
-    ((struct gpt_header *) header_copy)->header_crc32 = 0x00000000;
+bool entry_is_unused(struct partition_entry *entry) {
+    uuid null_uuid;
+
+    bzero(&null_uuid, sizeof(null_uuid));
+
+    return !memcmp(entry->partition_type_uuid, null_uuid, sizeof(uuid));
+}
+
+
+bool overwrite_entry_name(struct partition_entry *entry, char *utf8) {
+    if(!encode_partition_name(utf8, entry->partition_name)) {
+	describe_failure("The name \"%s\" isn't UTF-8 or is too long for an entry.\n", utf8);
+	return false;
+    }
+    return true;
+}
 
+
+uint32_t compute_header_crc32(block *header_block) {
     struct gpt_header *header = (struct gpt_header *) header_block;
     size_t size_to_checksum = header->header_size;
     if(size_to_checksum > sizeof(block))
 	size_to_checksum = sizeof(block);
     
+    return compute_header_crc32_of_size(header_block, size_to_checksum);
+}
+
+
+// With a constant size, only that much gets copied, and the copy is done in registers.
+static inline __attribute__((always_inline))
+uint32_t compute_header_crc32_of_size(block *header_block, size_t size_to_checksum) {
+    block header_copy;
+    memcpy(&header_copy, header_block, size_to_checksum);
+    
+    ((struct gpt_header *) header_copy)->header_crc32 = 0x00000000;
+
     return efi_crc32((uint8_t *) &header_copy, size_to_checksum);
 }
 
@@ -528,7 +830,7 @@ uint32_t compute_entry_crc32(struct gpt_header *header, block *entry_blocks) {
 
 
 uint64_t total_entry_size(struct gpt_header *header) {
-    return header->number_of_partition_entries * header->size_of_partition_entry;
+    return (uint64_t) header->number_of_partition_entries * header->size_of_partition_entry;
 }
 
 
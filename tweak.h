@@ -1,3 +1,5 @@
+#define _LARGEFILE64_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -8,6 +10,63 @@
 #include <string.h>
 #include <unistd.h>
 
+#define true 1
+#define false 0
+typedef uint8_t bool;
+typedef uint8_t block[512];
+typedef uint8_t uuid[16];
+typedef uint64_t lba;
+
+struct uuid {
+    uint32_t time_low; // Little-endian.
+    uint16_t time_mid; // Little-endian.
+    uint16_t time_high_and_version; // Little-endian.
+    uint8_t clock_seq_high_and_reserved;
+    uint8_t clock_seq_low;
+    uint8_t node[6];
+};
+
+struct gpt_header {
+    char signature[8];
+    uint32_t revision;
+    uint32_t header_size; // must be >= 92
+    uint32_t header_crc32;
+    // assume this field zero then compute over the first header_size bytes
+    uint32_t reserved; // must be zero
+    lba my_lba;
+    lba alternate_lba;
+    lba first_usable_lba;
+    lba last_usable_lba;
+    uuid disk_uuid;
+    lba partition_entry_lba;
+    uint32_t number_of_partition_entries;
+    uint32_t size_of_partition_entry; // must be a multiple of 8
+    uint32_t partition_entry_array_crc32;
+    // computed over number_of_partition_entries * size_of_partition_entry bytes
+    // Remaining bytes must all be zero.
+};
+
+struct partition_entry {
+    uuid partition_type_uuid;
+    uuid unique_partition_uuid;
+    lba starting_lba;
+    lba ending_lba;
+    uint64_t attributes;
+    uint8_t partition_name[72];
+};
+
+// bench.c
+extern void benchmark_table(int fd, char *devicename, int n_iterations);
+
+// clone.c
+extern int clone_table(int template_fd, char **targets, int n_targets);
+
+// daemon.c
+extern bool serve_tables(char *socket_path, char **devicenames, int n_devices);
+
+// diff.c
+extern int diff_tables(int fd_a, char *name_a, int fd_b, char *name_b);
+
 // efi_crc32.c
 extern uint32_t efi_crc32(uint8_t *buf, size_t len);
 extern uint32_t efi_crc32_start(uint8_t *buf, size_t len);
@@ -17,3 +76,100 @@ extern uint32_t efi_crc32_end(uint32_t seed);
 // ui.c
 extern int current_detail, cutoff_detail, describe_failures, describe_successes,
     describe_trivia;
+extern void describe_failure(char *fmt, ...);
+extern void describe_success(char *fmt, ...);
+extern void describe_trivium(char *fmt, ...);
+
+// tweak.c
+// The layout nearly every disk has: a 92-byte header, and 128 entries of 128 bytes each
+// starting at LBA 2.  Tables like that are validated by copies of the generic code with
+// these constants folded in; turning this off sends everything the generic way.
+#define CANONICAL_HEADER_SIZE 92
+#define CANONICAL_N_ENTRIES 128
+#define CANONICAL_ENTRY_SIZE 128
+#define CANONICAL_ENTRY_LBA 2
+#define CANONICAL_ENTRY_ARRAY_SIZE (CANONICAL_N_ENTRIES * CANONICAL_ENTRY_SIZE)
+extern bool canonical_fast_path;
+
+static inline bool is_canonical_geometry(struct gpt_header *header) {
+    return header->number_of_partition_entries == CANONICAL_N_ENTRIES
+	&& header->size_of_partition_entry == CANONICAL_ENTRY_SIZE
+	&& header->partition_entry_lba == CANONICAL_ENTRY_LBA;
+}
+
+int open_device(char *devicename, int flags);
+void tweak(int fd);
+void read_block(int fd, lba lba, block *data);
+bool try_read_block(int fd, lba lba, block *data);
+void read_bytes(int fd, uint64_t offset, void *data, size_t size);
+bool try_read_bytes(int fd, uint64_t offset, void *data, size_t size);
+bool get_device_size(int fd, uint64_t *size);
+void write_block(lba lba, block *data);
+bool write_bytes(int fd, uint64_t offset, void *data, size_t size);
+void hexdump_block(block *data);
+char *uuid_to_ascii(uuid uuid);
+bool validate_gpt_header(block *header, lba expected_lba);
+block *load_entry_array(int fd, struct gpt_header *header);
+bool validate_entry_array(struct gpt_header *header, block *entry_blocks);
+struct partition_entry *get_partition_entry(struct gpt_header *header,
+					    block *entry_blocks, lba index);
+bool entry_is_unused(struct partition_entry *entry);
+bool entry_geometry_is_sane(int fd, struct gpt_header *header);
+bool overwrite_entry_name(struct partition_entry *entry, char *utf8);
+uint32_t compute_header_crc32(block *header);
+uint32_t compute_entry_crc32(struct gpt_header *header, block *entry_blocks);
+uint64_t total_entry_size(struct gpt_header *header);
+block *load_table(int fd, block *header_block);
+bool commit_table(block *header_block, block *entry_blocks);
+char *get_type_uuid_name(uuid uuid);
+uuid *get_type_name_uuid(char *to_be_found);
+void swab_and_copy_uuid(uuid *target, uuid *source);
+void swab_uuid(uuid *uuid);
+void swab32(uint8_t *bytes);
+void swab16(uint8_t *bytes);
+
+// names.c
+// The name field holds 36 UTF-16LE code units; the worst case in UTF-8 is three bytes
+// per unit, since anything needing four bytes takes up two units.
+#define NAME_UTF8_SIZE (36*3 + 1)
+extern size_t decode_partition_name(uint8_t *name, char *utf8);
+extern bool encode_partition_name(char *utf8, uint8_t *name);
+extern bool search_names(int fd, char *devicename, char *pattern, uint8_t *new_name);
+
+// stats.c
+enum stats_phase {
+    PHASE_OPEN,
+    PHASE_READ_BLOCK,
+    PHASE_EFI_CRC32,
+    PHASE_VALIDATE_GPT_HEADER,
+    PHASE_VALIDATE_ENTRY_ARRAY,
+    PHASE_WRITE_BLOCK,
+    N_STATS_PHASES
+};
+enum stats_counter {
+    COUNTER_BYTES_READ,
+    COUNTER_BYTES_WRITTEN,
+    COUNTER_SYSCALLS,
+    COUNTER_CRC_BYTES,
+    COUNTER_ENTRIES_DECODED,
+    COUNTER_CACHE_HITS,
+    N_STATS_COUNTERS
+};
+// Build with "make STATS=1" to get these; otherwise they vanish entirely.
+#ifdef TWEAK_STATS
+extern uint64_t stats_now(void);
+extern void stats_begin_device(char *name);
+extern void stats_add_phase(enum stats_phase phase, uint64_t ns);
+extern void stats_add_counter(enum stats_counter counter, uint64_t n);
+extern void stats_print_summary(FILE *out);
+extern int stats_write_prometheus(char *filename);
+#define STATS_DEVICE(name) stats_begin_device(name)
+#define STATS_PHASE_BEGIN(phase) uint64_t phase##_began = stats_now()
+#define STATS_PHASE_END(phase) stats_add_phase(phase, stats_now() - phase##_began)
+#define STATS_COUNT(counter, n) stats_add_counter(counter, n)
+#else
+#define STATS_DEVICE(name) ((void) 0)
+#define STATS_PHASE_BEGIN(phase) ((void) 0)
+#define STATS_PHASE_END(phase) ((void) 0)
+#define STATS_COUNT(counter, n) ((void) 0)
+#endif